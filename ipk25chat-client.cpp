@@ -15,14 +15,29 @@
 #include <vector>
 #include <regex>
 #include <signal.h>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <algorithm>
+#include <string_view>
+#include <deque>
+#include <charconv>
 
 #include <sys/socket.h>
 #include <pcap.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netinet/ip.h>
+#include <netdb.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 // HElPER FUNCTIONS
 /**
@@ -38,30 +53,181 @@ void delete_new_line_or_carriage(std::string &msg) {
 }
 
 /**
- * @brief function convert the whole string to capital letters
+ * @brief function compares the start of the text with the prefix, ignoring case
  */
-std::string msg_to_upper(std::string msg) {
-    std::string upper_cmd;
-    for (auto &c : msg) {
-        c = toupper(c);
-        upper_cmd.append(1, c);
+bool starts_with_nocase(std::string_view text, std::string_view prefix) {
+    if (text.size() < prefix.size()) {
+        return false;
     }
-    return upper_cmd;
+    for (size_t i = 0; i < prefix.size(); i++) {
+        if (toupper(static_cast<unsigned char>(text[i])) != toupper(static_cast<unsigned char>(prefix[i]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief function finds the first occurrence ignoring case, npos if there is none
+ */
+size_t find_nocase(std::string_view text, std::string_view what) {
+    for (size_t i = 0; i + what.size() <= text.size(); i++) {
+        if (starts_with_nocase(text.substr(i), what)) {
+            return i;
+        }
+    }
+    return std::string_view::npos;
 }
 
 
+/**
+ * @brief class for timers used inside the epoll loop
+ *        all timers share one timerfd which is always armed to the earliest deadline,
+ *        pending timers are kept in a min-heap, cancelled ones are skipped when popped
+ */
+class Timers {
+    public:
+        int fd = -1;
+
+        struct timer {
+            uint64_t deadline;
+            uint64_t id;
+        };
+        std::vector<timer> heap;
+        std::unordered_map<uint64_t, std::function<void()>> callbacks;
+        uint64_t next_id = 1;
+
+        /**
+         * @brief method creates the timerfd, it has to be added to epoll afterwards
+         */
+        void setup() {
+            fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (fd == -1) {
+                std::cerr << "Couldn't create timer" << std::endl;
+                exit(1);
+            }
+        }
+
+        /**
+         * @brief returns nanoseconds of the monotonic clock (same clock as the timerfd)
+         */
+        static uint64_t now() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+        }
+
+        /**
+         * @brief method schedules callback to be called after delay
+         * @return id of the timer, needed for cancel
+         */
+        uint64_t add(std::chrono::nanoseconds delay, std::function<void()> callback) {
+            uint64_t id = next_id++;
+            heap.push_back({now() + delay.count(), id});
+            std::push_heap(heap.begin(), heap.end(), later);
+            callbacks[id] = std::move(callback);
+            rearm();
+            return id;
+        }
+
+        /**
+         * @brief method cancels the timer and resets the id to 0, unknown or 0 id is ignored
+         */
+        void cancel(uint64_t &id) {
+            if (id != 0) {
+                callbacks.erase(id);
+                id = 0;
+            }
+        }
+
+        /**
+         * @brief method is called when the timerfd is readable, runs all expired callbacks
+         */
+        void expire() {
+            uint64_t expirations;
+            // only to clear the readiness, the heap decides what expired
+            ssize_t count = read(fd, &expirations, sizeof(expirations));
+            (void)count;
+
+            uint64_t current = now();
+            while (!heap.empty() && heap.front().deadline <= current) {
+                uint64_t id = heap.front().id;
+                std::pop_heap(heap.begin(), heap.end(), later);
+                heap.pop_back();
+
+                auto it = callbacks.find(id);
+                if (it == callbacks.end()) {
+                    // cancelled
+                    continue;
+                }
+                // callback can add or cancel other timers
+                std::function<void()> callback = std::move(it->second);
+                callbacks.erase(it);
+                callback();
+            }
+            rearm();
+        }
+
+        /**
+         * @brief method sets the timerfd to the earliest pending deadline or disarms it
+         */
+        void rearm() {
+            // drop cancelled timers from the top so they don't wake us up
+            while (!heap.empty() && callbacks.find(heap.front().id) == callbacks.end()) {
+                std::pop_heap(heap.begin(), heap.end(), later);
+                heap.pop_back();
+            }
+            struct itimerspec spec;
+            memset(&spec, 0, sizeof(spec));
+            if (!heap.empty()) {
+                spec.it_value.tv_sec = heap.front().deadline / 1000000000ULL;
+                spec.it_value.tv_nsec = heap.front().deadline % 1000000000ULL;
+            }
+            timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+        }
+
+    private:
+        // comparator for min-heap
+        static bool later(const timer &a, const timer &b) {
+            return a.deadline > b.deadline;
+        }
+};
+
+
 /**
  * @brief class for parsing command line arguments
  */
 class arg_parse {
     public:
-        in_addr ip;
+        struct server_address {
+            in_addr ip;
+            // -1 = use -p
+            int port = -1;
+        };
+        // -s can be given more times, one connection for each
+        std::vector<server_address> servers;
         std::string protocol;
 
         // default values given by the assigment
         uint16_t port = 4567;
         uint16_t timeout = 250;
         uint8_t udp_max_retrans = 3;
+        // in miliseconds
+        uint32_t connect_timeout = 5000;
+        // in seconds, 0 = off
+        uint16_t keepalive = 0;
+        // in miliseconds, how long to wait for the output to be sent at the end
+        uint32_t shutdown_timeout = 2000;
+
+        // scripted mode
+        std::string script_path;
+        double rate = 0;
+        uint32_t burst = 1;
+        uint32_t delay = 0;
+
+        // more servers
+        bool relay = false;
+        bool stats = false;
 
         /**
          * @brief main method of this class, uses getopt to parse args
@@ -70,7 +236,17 @@ class arg_parse {
             int c;
             bool protocol_flag = false;
             bool server_flag = false;
-            while((c = getopt(argc, argv, "t:s:p:d:r:h")) != -1) {
+            // scripted mode has only long options
+            static struct option long_options[] = {
+                {"script", required_argument, NULL, 'S'},
+                {"rate", required_argument, NULL, 'R'},
+                {"burst", required_argument, NULL, 'B'},
+                {"delay", required_argument, NULL, 'D'},
+                {"relay", no_argument, NULL, 'L'},
+                {"stats", no_argument, NULL, 'T'},
+                {NULL, 0, NULL, 0}
+            };
+            while((c = getopt_long(argc, argv, "t:s:p:d:r:c:k:e:h", long_options, NULL)) != -1) {
                 switch(c) {
                     case 't':
                         protocol = optarg;
@@ -81,21 +257,7 @@ class arg_parse {
                         protocol_flag = true;
                         break;
                     case 's':
-                        if (inet_pton(AF_INET, optarg, &ip) != 1) {
-                            // its hostname
-                            struct addrinfo hints, *res;
-                            memset(&hints, 0, sizeof(hints));
-                            hints.ai_family = AF_INET;
-                            hints.ai_socktype = SOCK_STREAM;
-                            if (getaddrinfo(optarg, NULL, &hints, &res) != 0) {
-                                std::cerr << "Invalid server address" << std::endl;
-                                exit(1);
-                            }
-                            struct sockaddr_in *ipv4 = (struct sockaddr_in *)res->ai_addr;
-                            ip = ipv4->sin_addr;
-                            freeaddrinfo(res);
-
-                        }
+                        add_server(optarg);
                         server_flag = true;
                         break;
                     case 'p':
@@ -108,6 +270,37 @@ class arg_parse {
                     case 'r':
                         udp_max_retrans = static_cast<uint8_t>(std::stoul(optarg));
                         break;
+                    case 'c':
+                        connect_timeout = static_cast<uint32_t>(std::stoul(optarg));
+                        break;
+                    case 'k':
+                        keepalive = static_cast<uint16_t>(std::stoul(optarg));
+                        break;
+                    case 'e':
+                        shutdown_timeout = static_cast<uint32_t>(std::stoul(optarg));
+                        break;
+                    case 'S':
+                        script_path = optarg;
+                        break;
+                    case 'R':
+                        rate = std::stod(optarg);
+                        break;
+                    case 'B':
+                        burst = static_cast<uint32_t>(std::stoul(optarg));
+                        if (burst == 0) {
+                            std::cerr << "Burst has to be at least 1" << std::endl;
+                            exit(1);
+                        }
+                        break;
+                    case 'D':
+                        delay = static_cast<uint32_t>(std::stoul(optarg));
+                        break;
+                    case 'L':
+                        relay = true;
+                        break;
+                    case 'T':
+                        stats = true;
+                        break;
                     case 'h':
                         print_help();
                         exit(0);
@@ -121,16 +314,249 @@ class arg_parse {
                 std::cerr << "Protocol and server IP address are required" << std::endl;
                 exit(1);
             }
+            for (auto &server : servers) {
+                if (server.port == -1) {
+                    server.port = port;
+                }
+            }
+        }
+
+        /**
+         * @brief method resolves the server given by -s, it can be ip/hostname or ip/hostname:port
+         */
+        void add_server(std::string address) {
+            server_address server;
+            size_t colon = address.rfind(':');
+            if (colon != std::string::npos) {
+                server.port = static_cast<uint16_t>(std::stoul(address.substr(colon + 1)));
+                address.erase(colon);
+            }
+            if (inet_pton(AF_INET, address.c_str(), &server.ip) != 1) {
+                // its hostname
+                struct addrinfo hints, *res;
+                memset(&hints, 0, sizeof(hints));
+                hints.ai_family = AF_INET;
+                hints.ai_socktype = SOCK_STREAM;
+                if (getaddrinfo(address.c_str(), NULL, &hints, &res) != 0) {
+                    std::cerr << "Invalid server address" << std::endl;
+                    exit(1);
+                }
+                struct sockaddr_in *ipv4 = (struct sockaddr_in *)res->ai_addr;
+                server.ip = ipv4->sin_addr;
+                freeaddrinfo(res);
+
+            }
+            servers.push_back(server);
         }
         void print_help() {
             std::cout << "This program communicates with a server through stdin and stdout." << std::endl;
             std::cout << "How to use:" << std::endl;
             std::cout << "-t  = protocol - either TCP or UDP" << std::endl;
-            std::cout << "-s  = ip/hostname of server which will the program communicate with" << std::endl;
-            std::cout << "-p  = number of port" << std::endl;
+            std::cout << "-s  = ip/hostname[:port] of server which will the program communicate with, can be repeated" << std::endl;
+            std::cout << "-p  = number of port for servers given without one" << std::endl;
             std::cout << "-d  = timeout for udp in miliseconds" << std::endl;
             std::cout << "-r  = maximum number of packet send in udp when no response found" << std::endl;
+            std::cout << "-c  = timeout for connecting to the server in miliseconds" << std::endl;
+            std::cout << "-k  = seconds of silence before keepalive probes, dead connection is found in about twice the time (0 = off)" << std::endl;
+            std::cout << "-e  = on exit, how long to wait in miliseconds for the unsent data and BYE to be delivered" << std::endl;
             std::cout << "-h  = displays help message" << std::endl;
+            std::cout << "--script <file> = reads commands from the file instead of stdin" << std::endl;
+            std::cout << "--rate <n>  = maximum number of script lines sent per second (0 = unlimited)" << std::endl;
+            std::cout << "--burst <n> = how many script lines can be sent at once within the rate" << std::endl;
+            std::cout << "--delay <ms> = pause after every script line, a line \"@sleep <ms>\" pauses once" << std::endl;
+            std::cout << "--relay = with more servers, MSG from one server is forwarded to the others" << std::endl;
+            std::cout << "--stats = prints throughput of every connection to stderr at the end" << std::endl;
+        }
+};
+
+
+/**
+ * @brief class for interning display names and channel ids
+ *        every name gets a small id which never changes, the name is stored only once,
+ *        open addressing hash table with linear probing keeps only the ids
+ */
+class Intern_table {
+    public:
+        static constexpr uint32_t NONE = UINT32_MAX;
+        // names from the servers can't fill the memory, the rest shares one id
+        static constexpr uint32_t MAX_NAMES = 4096;
+        static constexpr uint32_t OTHER = MAX_NAMES;
+
+        // id -> name, deque so the names don't move when it grows
+        std::deque<std::string> names;
+        // 0 = empty, otherwise id + 1, size is power of 2
+        std::vector<uint32_t> slots = std::vector<uint32_t>(64, 0);
+
+        /**
+         * @brief returns id of the name, new id is given only to a name not seen before,
+         *        when the table is full new names get OTHER
+         */
+        uint32_t intern(std::string_view name) {
+            // keep it at most 3/4 full
+            if (names.size() < MAX_NAMES && (names.size() + 1) * 4 > slots.size() * 3) {
+                grow();
+            }
+            size_t mask = slots.size() - 1;
+            size_t i = hash(name) & mask;
+            while (slots[i] != 0) {
+                if (names[slots[i] - 1] == name) {
+                    return slots[i] - 1;
+                }
+                i = (i + 1) & mask;
+            }
+            if (names.size() >= MAX_NAMES) {
+                return OTHER;
+            }
+            names.emplace_back(name);
+            slots[i] = names.size();
+            return names.size() - 1;
+        }
+
+        std::string_view name(uint32_t id) {
+            if (id == OTHER) {
+                return "(other)";
+            }
+            return names[id];
+        }
+
+    private:
+        // FNV-1a
+        static size_t hash(std::string_view name) {
+            size_t h = 14695981039346656037ULL;
+            for (char c : name) {
+                h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ULL;
+            }
+            return h;
+        }
+
+        void grow() {
+            std::vector<uint32_t> bigger(slots.size() * 2, 0);
+            size_t mask = bigger.size() - 1;
+            for (uint32_t slot : slots) {
+                if (slot == 0) {
+                    continue;
+                }
+                size_t i = hash(names[slot - 1]) & mask;
+                while (bigger[i] != 0) {
+                    i = (i + 1) & mask;
+                }
+                bigger[i] = slot;
+            }
+            slots.swap(bigger);
+        }
+};
+
+
+/**
+ * @brief class for building the messages sent to the server
+ *        the message is kept as parts pointing to its fields, so nothing is joined,
+ *        CHAT::send_frame writes the parts to the socket or copies them once to the send queue
+ *        fields from the user are checked here, display name is checked when it is set
+ */
+class Frame {
+    public:
+        // the longest is AUTH with 7 parts
+        struct iovec parts[8];
+        int count = 0;
+        size_t size = 0;
+
+        static constexpr size_t MAX_CONTENT = 60000;
+
+        void add(std::string_view part) {
+            parts[count].iov_base = const_cast<char *>(part.data());
+            parts[count].iov_len = part.size();
+            count++;
+            size += part.size();
+        }
+
+        /**
+         * @brief [A-Za-z0-9_-]{1,max}, used for username, channel id and secret
+         */
+        static bool is_id(std::string_view field, size_t max) {
+            if (field.empty() || field.size() > max) {
+                return false;
+            }
+            for (char c : field) {
+                if (!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-') {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief [!-~]{1,20}
+         */
+        static bool is_display_name(std::string_view field) {
+            if (field.empty() || field.size() > 20) {
+                return false;
+            }
+            for (char c : field) {
+                if (c < '!' || c > '~') {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        /**
+         * @brief content can't be empty, too long or end the message early
+         */
+        static bool is_content(std::string_view field) {
+            return !field.empty() && field.size() <= MAX_CONTENT && field.find('\r') == std::string_view::npos;
+        }
+
+        bool auth(std::string_view username, std::string_view secret, std::string_view display_name) {
+            if (!is_id(username, 20) || !is_id(secret, 128) || !is_display_name(display_name)) {
+                return false;
+            }
+            add("AUTH ");
+            add(username);
+            add(" AS ");
+            add(display_name);
+            add(" USING ");
+            add(secret);
+            add("\r\n");
+            return true;
+        }
+
+        bool join(std::string_view channel_id, std::string_view display_name) {
+            if (!is_id(channel_id, 20)) {
+                return false;
+            }
+            add("JOIN ");
+            add(channel_id);
+            add(" AS ");
+            add(display_name);
+            add("\r\n");
+            return true;
+        }
+
+        bool msg(std::string_view display_name, std::string_view content) {
+            return with_content("MSG FROM ", display_name, content);
+        }
+
+        bool err(std::string_view display_name, std::string_view content) {
+            return with_content("ERR FROM ", display_name, content);
+        }
+
+        void bye(std::string_view display_name) {
+            add("BYE FROM ");
+            add(display_name);
+            add("\r\n");
+        }
+
+    private:
+        bool with_content(std::string_view type, std::string_view display_name, std::string_view content) {
+            if (!is_content(content)) {
+                return false;
+            }
+            add(type);
+            add(display_name);
+            add(" IS ");
+            add(content);
+            add("\r\n");
+            return true;
         }
 };
 
@@ -141,29 +567,38 @@ class arg_parse {
  */
 class Message {
     public:
-        std::string msg;
         std::string cmd;
+        // user input without the new line, points to the stdin buffer or to the script,
+        // for answer it's the received frame, points into the receive buffer
+        std::string_view input;
+        // input without the command
+        std::string_view rest;
 
         int socket;
         int connection;
-
-        // all possible parts of messages
+        // with more servers it tells which one the message came from, kept by the connection
+        std::string_view origin;
+        // display names of senders, set by answer for MSG and ERR
+        Intern_table *senders = nullptr;
+        uint32_t sender = Intern_table::NONE;
+        // parts of MSG and ERR found by answer, point into input
+        std::string_view display;
+        std::string_view content;
+        // set by malformed_answer
+        bool malformed = false;
+
+        // all possible parts of messages, shared so a new Message doesn't allocate
         uint16_t MSG_ID;
-        std::string RN = R"(\r\n)";
-        std::string USERNAME = R"([A-Za-z0-9_-]{1,20})";
-        std::string CHANNEL_ID = R"([A-Za-z0-9_-]{1,20})";
-        std::string SECRET = R"([A-Za-z0-9_-]{1,128})";
-        std::string DISPLAY_NAME = R"([!-~]{1,20})";
-
-        std::string ID = R"([A-Za-z0-9_-]{1,20})";
-        std::string DNAME = R"([!-~]{1,20})";
-
-        std::string SP = R"( )";
-        std::string IS = R"( IS )";
-        std::string AS = R"( AS )";
-        std::string USING = R"( USING )";
-        std::string OK_NOK = R"(OK|NOK)";
-        std::string FROM = R"(FROM )";
+        static constexpr std::string_view RN = R"(\r\n)";
+
+        static constexpr std::string_view ID = R"([A-Za-z0-9_-]{1,20})";
+        static constexpr std::string_view DNAME = R"([!-~]{1,20})";
+
+        static constexpr std::string_view SP = R"( )";
+        static constexpr std::string_view IS = R"( IS )";
+        static constexpr std::string_view AS = R"( AS )";
+        static constexpr std::string_view OK_NOK = R"(OK|NOK)";
+        static constexpr std::string_view FROM = R"(FROM )";
 
         int REPLY_OK_POS = 12;
         int REPLY_NOK_POS = 13;
@@ -172,66 +607,58 @@ class Message {
         
         /**
          * @brief method is called when a malformed message is received
-         *        prints out error to stdout, send an error msg to the server
-         *        and closes the connection and exits
+         *        prints out error to stdout and marks the message,
+         *        the caller sends ERR and BYE and ends only this connection (CHAT::malformed)
          */
-        void malformed_answer(std::string msg,std::string display_name) {
-            // local error, err to server, bye, close connection/socket, exit
+        void malformed_answer(std::string msg) {
             std::cout << "ERROR: " << msg << std::endl;
-            delete_new_line_or_carriage(display_name);
-            std::string err_msg = "ERR FROM " + display_name + IS + msg + "\r\n";
-
-            send(socket, err_msg.c_str(), err_msg.size(), 0);
-            if(connection > 0) {
-                close(connection);
-            }
-            if(socket > 0) {
-                close(socket);
-            }
-            exit(1);
+            malformed = true;
         }
 
         /**
          * @brief method is called when a message is received from stdin
          *        it parses the message and sets the cmd and msg variables
+         *        the buffer is owned by the caller and reused, input points into it
+         * @return false on ctrl+d/eof, the caller ends the connections
          */
-        void decipher(std::string display_name) {
+        bool decipher(std::vector<char> &buffer) {
             fcntl(STDIN_FILENO, F_SETFL, O_NONBLOCK); 
-            // the max should be content 60000 + tmsg from + dname + is
-            char buf[60034];
-
             // non-blocking reading
-            ssize_t count = read(STDIN_FILENO, buf, sizeof(buf));
+            ssize_t count = read(STDIN_FILENO, buffer.data(), buffer.size());
+            input = std::string_view(buffer.data(), count > 0 ? count : 0);
 
-            if (count > 0) {
-                msg = std::string(buf, count);
-            }
             // if ctrl+d/eof
-            if (count == 0 || msg.find("\x04") != std::string::npos) {
-                delete_new_line_or_carriage(display_name);
+            if (count == 0 || input.find('\x04') != std::string_view::npos) {
+                return false;
+            }
+            split_cmd();
+            return true;
+        }
 
-                std::string bye = "BYE FROM " + display_name + "\r\n";
-                send(socket, bye.c_str(), bye.size(), 0);
-                close(connection);
-                close(socket);
-                exit(0);
+        /**
+         * @brief method splits input into the command and the rest of the message
+         *        used for stdin and for lines from the script, nothing is copied except cmd
+         */
+        void split_cmd() {
+            if (input.ends_with('\n')) {
+                input.remove_suffix(1);
+            }
+            if (input.ends_with('\r')) {
+                input.remove_suffix(1);
             }
-        
             // only one word -> cmd empty
             // could be a msg of one word
-            size_t cmd_end = msg.find(' ');
-            if (cmd_end == std::string::npos) {
+            size_t cmd_end = input.find(' ');
+            if (cmd_end == std::string_view::npos) {
                 cmd = "";
+                rest = input;
             } else {
-               cmd =  msg.substr(0, cmd_end);
+                cmd = std::string(input.substr(0, cmd_end));
+                rest = input.substr(cmd_end + 1);
             }
 
             if (cmd[0] == '/') {
                 cmd.erase(0, 1);
-            } 
-            // delete command from the rest of the message
-            if (cmd_end != std::string::npos) {
-                msg.erase(0, cmd_end + 1);
             }
             // make cmd lowercase so i can compare it later
             std::string lower_cmd;
@@ -246,175 +673,278 @@ class Message {
          * @brief method for handling the data from the server
          *        check the format and if the data are incorrect calls malformed_answer
          */
-        void answer(std::string display_name) {
+        void answer() {
             // regex stoped working for longer patterns
-            std::string upper_msg = msg_to_upper(msg);
+            // the frame isn't copied, case is ignored in place
             if (cmd == "BYE") {
-                std::string bye = FROM + SP + DNAME + RN;
-                std::regex bye_regex(bye);
-                if(!std::regex_match(upper_msg,bye_regex)) {
-                   malformed_answer(msg,display_name);
+                // compiled only once
+                static const std::regex bye_regex(std::string(FROM) + std::string(SP) + std::string(DNAME) + std::string(RN),
+                                                  std::regex::icase);
+                if(!std::regex_match(input.begin(), input.end(), bye_regex)) {
+                   malformed_answer(std::string(input));
+                   return;
                 }
                 return;
             } else if (cmd == "ERR") {
-                size_t is_pos = upper_msg.find(IS);
-                std::string display = msg.substr(MSG_FROM_POS, is_pos - MSG_FROM_POS);
-                if(is_pos == std::string::npos) {
-                    malformed_answer(msg, display_name);
+                size_t is_pos = find_nocase(input, IS);
+                if(is_pos == std::string::npos || is_pos < static_cast<size_t>(MSG_FROM_POS)) {
+                    malformed_answer(std::string(input));
+                    return;
+                }
+                // only views, the sender is kept as id
+                display = input.substr(MSG_FROM_POS, is_pos - MSG_FROM_POS);
+                content = input.substr(is_pos + 4);
+                // only valid names are counted, a bad one would only fill the table
+                if (senders != nullptr && Frame::is_display_name(display)) {
+                    sender = senders->intern(display);
                 }
-                std::string message_content = msg.substr(is_pos + 4, msg.length() - is_pos +4 );
 
-                std::cout << "ERROR FROM " << display << ": " << message_content << std::endl;
+                std::cout << origin << "ERROR FROM " << display << ": " << content << std::endl;
 
             } else if (cmd == "JOIN") {
-                std::string join = ID + AS + DNAME + "\r\n";
-                std::regex join_regex(join);
-                if(!std::regex_match(upper_msg,join_regex)) {
-                   malformed_answer(msg,display_name);
+                static const std::regex join_regex(std::string(ID) + std::string(AS) + std::string(DNAME) + "\r\n",
+                                                   std::regex::icase);
+                if(!std::regex_match(input.begin(), input.end(), join_regex)) {
+                   malformed_answer(std::string(input));
+                   return;
                 }
                 return;
 
             } else if (cmd == "MSG") {
-                size_t is_pos = upper_msg.find(IS);
-                if(is_pos == std::string::npos) {
-                    malformed_answer(msg,display_name);
+                size_t is_pos = find_nocase(input, IS);
+                if(is_pos == std::string::npos || is_pos < static_cast<size_t>(MSG_FROM_POS)) {
+                    malformed_answer(std::string(input));
+                    return;
                 }
-                std::string display = msg.substr(MSG_FROM_POS, is_pos - MSG_FROM_POS);
-                std::string content = msg.substr(is_pos + 4, msg.length() - is_pos +4 );  
-                std::cout << display << ": " << content << std::endl;
-
-            } else if (cmd == "REPLY") {
-                if (upper_msg.rfind("REPLY OK IS ", 0) == 0 || upper_msg.rfind("REPLY NOK IS ", 0) == 0) {
-                    std::string content = upper_msg.substr(upper_msg.find("IS ") + 3);
-                } else {
-                    malformed_answer(msg,display_name);
+                display = input.substr(MSG_FROM_POS, is_pos - MSG_FROM_POS);
+                content = input.substr(is_pos + 4);
+                // only valid names are counted, a bad one would only fill the table
+                if (senders != nullptr && Frame::is_display_name(display)) {
+                    sender = senders->intern(display);
                 }
-                delete_new_line_or_carriage(msg);
+                std::cout << origin << display << ": " << content << std::endl;
 
+            } else if (cmd == "REPLY") {
                 // if ok - action sucsess
-                if (upper_msg.find("REPLY NOK IS ") != std::string::npos) {
-                    std::cout << "Action Failure: " << msg.substr(REPLY_NOK_POS, msg.length())<< std::endl;
-                }
-                else if(upper_msg.find("REPLY OK IS ") != std::string::npos) {
-                    std::cout << "Action Success: " << msg.substr(REPLY_OK_POS, msg.length()) << std::endl;
+                if (starts_with_nocase(input, "REPLY NOK IS ")) {
+                    std::cout << origin << "Action Failure: " << input.substr(REPLY_NOK_POS) << std::endl;
+                } else if (starts_with_nocase(input, "REPLY OK IS ")) {
+                    std::cout << origin << "Action Success: " << input.substr(REPLY_OK_POS) << std::endl;
+                } else {
+                    malformed_answer(std::string(input));
+                    return;
                 }
 
                 return;
             } else {
-                malformed_answer(msg,display_name);
+                malformed_answer(std::string(input));
+                return;
             }
         }
 
 
         /**
-         * @brief method used parse message into vector, so the access to individual parts is better latter
+         * @brief method for printing help message
          */
-        void format_msg(std::vector<std::string>& params) {
-            size_t start = 0;
-            size_t end = msg.find(SP);
-            
-            while (end != std::string::npos) {
-                params.push_back(msg.substr(start, end - start));
-                start = end + SP.length();
-                end = msg.find(SP, start);
-            }
-            params.push_back(msg.substr(start));
+        void print_help() {
+            std::cout << "Possible commands:" << std::endl;
+            std::cout << "/auth <username> <secret> <display_name> = authenticates the user with the server" << std::endl;
+            std::cout << "/join <channel_id> = joins a different channel" << std::endl;
+            std::cout << "/rename <new_display_name> = changes user's display name" << std::endl;
+            std::cout << "/help = prints this help message" << std::endl;
         }
-        /**
-         * @brief method check the format and create a message that will be sent to the server
-         */
-        int msg_check(std::string display_name) {
-            if (cmd == "auth") {
-                std::string auth = USERNAME + SP + SECRET + SP + DISPLAY_NAME + "\n";
-                std::regex auth_regex(auth);
-                if(!std::regex_match(msg,auth_regex)) {
-                   std::cout << "ERROR: Invalid auth format" << std::endl;
-                   return 1;
-                }
-                std::vector<std::string> params;
-                format_msg(params);
-                delete_new_line_or_carriage(params[2]);
-
-                msg = "AUTH " + params[0] + AS + params[2] + USING + params[1] +  "\r\n";
-                return 0;
+};
 
-            } else if (cmd == "join") {
-                std::string join = CHANNEL_ID + "\n";
-                std::regex join_regex(join);
 
-                if(!std::regex_match(msg,join_regex)) {
-                   malformed_answer(msg,display_name);
-                }
-                std::vector<std::string> params;
-                format_msg(params);
-                delete_new_line_or_carriage(display_name);
-                delete_new_line_or_carriage(params[0]);
-                // something was still hanging in msg
-                msg.clear();
-
-                msg = "JOIN " + params[0] + AS + display_name + "\r\n";
-                return 0;
+/**
+ * @brief class for the scripted mode, holds the command file and the token bucket
+ *        regular files are memory-mapped, pipes are read as the data come through epoll
+ */
+class Script {
+    public:
+        int fd = -1;
+        char *map = nullptr;
+        size_t map_size = 0;
+        std::string stream;
+        bool eof = false;
+        // all lines were sent
+        bool done = false;
+        size_t pos = 0;
+        // streamed script is out of the epoll while a whole line waits to be sent
+        bool paused = false;
+
+        // token bucket, rate 0 = unlimited
+        double rate = 0;
+        double burst = 1;
+        double tokens = 0;
+        uint64_t last_refill = 0;
+        uint32_t delay = 0;
+        uint64_t timer = 0;
+
+        // for the final report
+        uint64_t start = 0;
+        uint64_t sent = 0;
 
-            } else if (cmd == "rename") {
-                std::string rename = DISPLAY_NAME + "\n";
-                std::regex rename_regex(rename);
-                if(!std::regex_match(msg,rename_regex)) {
-                   std::cout << "ERROR: Invalid rename format" << std::endl;
-                   return 1;
+        /**
+         * @brief method opens the script, maps it into memory if it is a regular file
+         */
+        void open_file(const std::string &path) {
+            fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                std::cerr << "Couldn't open script " << path << ": " << strerror(errno) << std::endl;
+                exit(1);
+            }
+            struct stat st;
+            if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                map_size = st.st_size;
+                eof = true;
+                if (map_size > 0) {
+                    void *data = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (data == MAP_FAILED) {
+                        std::cerr << "Couldn't map script " << path << std::endl;
+                        exit(1);
+                    }
+                    map = static_cast<char *>(data);
+                    madvise(map, map_size, MADV_SEQUENTIAL);
                 }
-                return 0;
-            
+                close(fd);
+                fd = -1;
             } else {
-                if (msg.length() > 60000) {
-                    std::cout << "ERROR: Message too long" << std::endl;
-                    return 1;
+                // pipe or fifo, added to the epoll
+                int flags = fcntl(fd, F_GETFL, 0);
+                fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+            }
+            tokens = burst;
+            last_refill = start = Timers::now();
+        }
+
+        /**
+         * @brief method reads from the streamed script until there is a whole line
+         *        more isn't read, the rest waits in the pipe until the lines are sent
+         */
+        void fill() {
+            // drop the lines which were already used, only the unfinished line is left
+            if (pos > 0) {
+                stream.erase(0, pos);
+                pos = 0;
+            }
+            char buf[4096];
+            ssize_t count;
+            while ((count = read(fd, buf, sizeof(buf))) > 0) {
+                stream.append(buf, count);
+                if (memchr(buf, '\n', count) != nullptr) {
+                    return;
                 }
-                delete_new_line_or_carriage(msg);
-                delete_new_line_or_carriage(display_name);
+            }
+            if (count == 0) {
+                // closing also removes it from the epoll
+                eof = true;
+                close(fd);
+                fd = -1;
+            }
+        }
 
-                if (cmd == "") {
-                    if(msg == "/help") {
-                        print_help();
-                        return 0;
-                    }
-                    msg = "MSG FROM " + display_name + " IS " + msg + "\r\n";
-                } else {
-                    msg = "MSG FROM " + display_name + " IS " + cmd + SP + msg + "\r\n";
+        /**
+         * @brief method finds the next whole line without consuming it
+         * @return false if no whole line is available yet
+         */
+        bool peek_line(std::string_view &line, size_t &next) {
+            std::string_view data = map != nullptr ? std::string_view(map, map_size) : std::string_view(stream);
+            if (pos >= data.size()) {
+                return false;
+            }
+            size_t end = data.find('\n', pos);
+            if (end == std::string_view::npos) {
+                // last line without \n
+                if (!eof) {
+                    return false;
                 }
-                return 0;
+                end = data.size();
+            }
+            line = data.substr(pos, end - pos);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
             }
+            next = end + 1;
+            return true;
         }
-        
-        
+
+        bool line_ready() {
+            return map == nullptr && stream.find('\n', pos) != std::string::npos;
+        }
+
+        bool finished() {
+            size_t size = map != nullptr ? map_size : stream.size();
+            return eof && pos >= size;
+        }
+
         /**
-         * @brief method for printing help message
+         * @brief method refills the bucket by the time passed and takes a token if there is one
+         * @return 0 if the token was taken, otherwise nanoseconds until the next one
          */
-        void print_help() {
-            std::cout << "Possible commands:" << std::endl;
-            std::cout << "/auth <username> <secret> <display_name> = authenticates the user with the server" << std::endl;
-            std::cout << "/join <channel_id> = joins a different channel" << std::endl;
-            std::cout << "/rename <new_display_name> = changes user's display name" << std::endl;
-            std::cout << "/help = prints this help message" << std::endl;
+        uint64_t take_token() {
+            if (rate <= 0) {
+                return 0;
+            }
+            uint64_t current = Timers::now();
+            tokens = std::min(burst, tokens + (current - last_refill) * rate / 1e9);
+            last_refill = current;
+            if (tokens >= 1) {
+                tokens -= 1;
+                return 0;
+            }
+            // at least 1 ns so the timer is really set
+            return static_cast<uint64_t>((1 - tokens) / rate * 1e9) + 1;
         }
 };
 
 
 /**
  * @brief class for handling the main logic,
- *       it sets up the socket, handles the epoll and the FSM
+ *       it sets up the sockets, handles the epoll and the FSM of every connection
  */
 class CHAT {
     public:
-        in_addr ip;
-        uint16_t port;
         uint16_t timeout;
         uint8_t udp_max_retrans;
+        uint32_t connect_timeout;
+        uint16_t keepalive;
+        uint32_t shutdown_timeout;
+        // given by the protocol
+        uint32_t reply_timeout = 5000;
 
-        static int new_socket;
-        static int connection;
         bool tcp;
-
-        std::string display_name;
+        bool relay = false;
+        bool stats = false;
+
+        int epoll_fd = -1;
+        int signal_fd = -1;
+        bool shutting_down = false;
+        Timers timers;
+        // exit code used when the last connection is closed
+        int exit_code = 0;
+
+        // REPLY latency, measured from sending AUTH or JOIN
+        uint64_t replies = 0;
+        uint64_t reply_latency_sum = 0;
+        uint64_t reply_latency_min = UINT64_MAX;
+        uint64_t reply_latency_max = 0;
+
+        bool scripted = false;
+        Script script;
+
+        // the max should be content 60000 + tmsg from + dname + is,
+        // allocated once, the line is not copied again until it is sent
+        std::vector<char> stdin_buffer = std::vector<char>(60034);
+
+        Intern_table senders;
+        Intern_table channels;
+        // indexed by the sender id, MSG and ERR from servers
+        struct sender_stats {
+            uint64_t msgs = 0;
+            uint64_t bytes = 0;
+        };
+        std::vector<sender_stats> sender_counters;
 
         enum states {
             IDLE,
@@ -424,23 +954,197 @@ class CHAT {
             END
         };
 
-        states state = IDLE;
-        states next_state = IDLE;
+        /**
+         * @brief class for one server, each has its own FSM, receive buffer and outbound queue
+         */
+        class Connection {
+            public:
+                size_t index;
+                in_addr ip;
+                uint16_t port;
+                int socket = -1;
+                bool connected = false;
+                bool closed = false;
+                // BYE queued, waiting for the output to be delivered
+                bool closing = false;
+                bool write_shut = false;
+                // "[n] " before the printed messages, only with more servers
+                std::string origin;
+
+                uint64_t connect_timer = 0;
+                uint64_t reply_timer = 0;
+                uint64_t reply_sent_at = 0;
+                uint64_t drain_timer = 0;
+                uint64_t drain_deadline = 0;
+
+                std::string display_name;
+                // id in channels, the last joined one
+                uint32_t channel = Intern_table::NONE;
+                states state = IDLE;
+                states next_state = IDLE;
+
+                // in case msgs were in multiple packets
+                std::string recv_buffer;
+                // data the socket didn't take yet, sent on EPOLLOUT
+                std::string out;
+                size_t out_pos = 0;
+
+                // throughput
+                uint64_t started = 0;
+                uint64_t ended = 0;
+                uint64_t msgs_in = 0;
+                uint64_t bytes_in = 0;
+                uint64_t msgs_out = 0;
+                uint64_t bytes_out = 0;
+                uint64_t relayed = 0;
+        };
+        // not resized after setup_socket, timers keep only the index
+        std::vector<Connection> connections;
+
+        void add_server(in_addr ip, uint16_t port) {
+            Connection conn;
+            conn.index = connections.size();
+            conn.ip = ip;
+            conn.port = port;
+            connections.push_back(conn);
+        }
 
         /**
          * @brief method send bye msg and closes the connection
+         *        the socket is closed after everything queued is delivered (or after shutdown_timeout)
+         */
+        void safely_end(Connection &conn) {
+            if (conn.closing) {
+                return;
+            }
+            // nothing was sent yet, so there is nothing to deliver
+            if (!conn.connected) {
+                close_connection(conn);
+                return;
+            }
+            // REPLY can't come after BYE, nothing else goes out after it either
+            timers.cancel(conn.reply_timer);
+            conn.next_state = END;
+            delete_new_line_or_carriage(conn.display_name);
+            Frame frame;
+            frame.bye(conn.display_name);
+            send_frame(conn, frame);
+            std::cout.flush();
+            conn.closing = true;
+
+            size_t index = conn.index;
+            conn.drain_deadline = timers.add(std::chrono::milliseconds(shutdown_timeout), [this, index]() {
+                connections[index].drain_deadline = 0;
+                std::cerr << "Output to the server was not delivered in time" << std::endl;
+                close_connection(connections[index]);
+            });
+            drain(conn);
+        }
+
+        /**
+         * @brief method closes the connection once the queue is empty and the server acked all data
+         *        checked again on EPOLLOUT and every 10 ms, the server closing the connection ends it too
          */
-        void safely_end(int socket, int connection) {
-            delete_new_line_or_carriage(display_name);
-            std::string bye_msg = "BYE FROM " + display_name + "\r\n";
-            send(socket, bye_msg.c_str(), bye_msg.size(), 0);
-            if (connection > 0) {
-                close(connection);
+        void drain(Connection &conn) {
+            timers.cancel(conn.drain_timer);
+            if (conn.out_pos < conn.out.size()) {
+                // flush_out calls this again
+                return;
+            }
+            if (!conn.write_shut) {
+                shutdown(conn.socket, SHUT_WR);
+                conn.write_shut = true;
+            }
+            // unacked bytes, including FIN
+            int unsent = 0;
+            if (ioctl(conn.socket, SIOCOUTQ, &unsent) == -1 || unsent == 0) {
+                close_connection(conn);
+                return;
             }
-            if (socket > 0) {
-                close(socket);
+            size_t index = conn.index;
+            conn.drain_timer = timers.add(std::chrono::milliseconds(10), [this, index]() {
+                connections[index].drain_timer = 0;
+                drain(connections[index]);
+            });
+        }
+
+        /**
+         * @brief method ends all connections, used on ctrl+c, signals and ctrl+d
+         */
+        void end_all() {
+            shutting_down = true;
+            for (auto &conn : connections) {
+                if (!conn.closed) {
+                    // BYE goes right away, other events in the same epoll batch can't undo it
+                    conn.next_state = END;
+                    safely_end(conn);
+                }
             }
         }
+
+        /**
+         * @brief method blocks the signals, so they are read from signalfd in the epoll loop
+         *        has to be called before anything else, so the signal can't come too early
+         */
+        void setup_signals() {
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGINT);
+            sigaddset(&signals, SIGTERM);
+            sigaddset(&signals, SIGUSR1);
+            sigprocmask(SIG_BLOCK, &signals, NULL);
+            signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+            if (signal_fd == -1) {
+                std::cerr << "Couldn't create signalfd" << std::endl;
+                exit(1);
+            }
+        }
+
+        /**
+         * @brief method is called when a signal comes, first one starts graceful shutdown
+         *        the second one closes everything right away
+         */
+        void receiving_signal() {
+            struct signalfd_siginfo info;
+            while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                if (shutting_down) {
+                    for (auto &conn : connections) {
+                        close_connection(conn);
+                    }
+                    return;
+                }
+                end_all();
+            }
+        }
+
+        /**
+         * @brief method closes the socket, the program ends when the last connection is closed
+         */
+        void close_connection(Connection &conn) {
+            if (conn.closed) {
+                return;
+            }
+            timers.cancel(conn.connect_timer);
+            timers.cancel(conn.reply_timer);
+            timers.cancel(conn.drain_timer);
+            timers.cancel(conn.drain_deadline);
+            // closing also removes it from the epoll
+            close(conn.socket);
+            conn.socket = -1;
+            conn.closed = true;
+            conn.ended = Timers::now();
+
+            for (auto &other : connections) {
+                if (!other.closed) {
+                    return;
+                }
+            }
+            if (stats) {
+                print_stats();
+            }
+            std::cout.flush();
+            exit(exit_code);
+        }
         
 
         /**
@@ -448,49 +1152,54 @@ class CHAT {
          *        it checks the current state and the command received
          *        and decides on the next state
          */
-        void change_state(std::string cmd, std::string msg, std::string upper_msg) {
-            delete_new_line_or_carriage(msg);
-            if(state == IDLE ) {
+        void change_state(Connection &conn, std::string_view cmd, std::string_view msg) {
+            // the connection is already ending, END is final
+            if (conn.next_state == END) {
+                return;
+            }
+            if(conn.state == IDLE ) {
                 if (cmd == "ERR" || cmd == "BYE") {
-                    next_state = END;
+                    conn.next_state = END;
                 } else {
                     // no specified
-                    next_state = IDLE;
+                    conn.next_state = IDLE;
                     std::cout << "ERROR: " << msg << std::endl;
                 }
-            } else if (state == AUTH) {
+            } else if (conn.state == AUTH) {
                 if (cmd == "REPLY") {
-                    if(upper_msg.find("REPLY OK") != std::string::npos) {
+                    reply_received(conn);
+                    if(starts_with_nocase(msg, "REPLY OK")) {
                     //     // if ok
-                        next_state = OPEN;
-                    } else if (upper_msg.find("REPLY NOK") != std::string::npos) {
+                        conn.next_state = OPEN;
+                    } else if (starts_with_nocase(msg, "REPLY NOK")) {
 
-                        next_state = AUTH;
+                        conn.next_state = AUTH;
                     } 
                 } else if (cmd == "ERR" || cmd == "BYE" || cmd == "MSG") {
-                    next_state = END;
+                    conn.next_state = END;
                 } else {
                     // no specified
                     std::cout << "ERROR: " << msg << std::endl;
 
                 }
-            } else if (state == OPEN) {
+            } else if (conn.state == OPEN) {
                 if(cmd == "MSG") {
-                    next_state = OPEN;
+                    conn.next_state = OPEN;
                     // nok and ok
                 } else if (cmd == "ERR" || cmd == "BYE" || cmd == "REPLY") {
-                    next_state = END;
+                    conn.next_state = END;
                 } else {
                     // no specified
                     std::cout << "ERROR: " << msg << std::endl;
                 }
-            } else if (state == JOIN) {
+            } else if (conn.state == JOIN) {
                 if(cmd == "REPLY") {
-                    next_state = OPEN;
+                    reply_received(conn);
+                    conn.next_state = OPEN;
                 } else if (cmd == "MSG") {
-                    next_state = JOIN;
+                    conn.next_state = JOIN;
                 } else if(cmd == "ERR" || cmd == "BYE") {
-                    next_state = END;
+                    conn.next_state = END;
                 } else {
                     // no specified
                     std::cout << "ERROR: " << msg << std::endl;
@@ -499,83 +1208,432 @@ class CHAT {
         }
         
         /**
-         * @brief method sets up the socket and calls the start_chat method
+         * @brief method sets up the sockets and calls the start_chat method
          */
         void setup_socket() {
-            int new_socket;
             if(tcp == true) {
-                new_socket = socket(AF_INET, SOCK_STREAM, 0);
-                if (new_socket < 0) {
-                    std::cerr << "Couldn't create a socket" << std::endl;
-                    exit(1);
-                }
-                int flags = fcntl(new_socket, F_GETFL, 0);
-                fcntl(new_socket, F_SETFL, flags | O_NONBLOCK);
+                for (auto &conn : connections) {
+                    if (connections.size() > 1) {
+                        conn.origin = "[" + std::to_string(conn.index + 1) + "] ";
+                    }
+                    int new_socket = socket(AF_INET, SOCK_STREAM, 0);
+                    if (new_socket < 0) {
+                        std::cerr << "Couldn't create a socket" << std::endl;
+                        exit(1);
+                    }
+                    int flags = fcntl(new_socket, F_GETFL, 0);
+                    fcntl(new_socket, F_SETFL, flags | O_NONBLOCK);
+                    if (keepalive > 0) {
+                        set_keepalive(new_socket);
+                    }
 
 
-                struct sockaddr_in server_address;
-                server_address.sin_family = AF_INET;
-                server_address.sin_port = htons(port);
-                server_address.sin_addr = ip;
+                    struct sockaddr_in server_address;
+                    server_address.sin_family = AF_INET;
+                    server_address.sin_port = htons(conn.port);
+                    server_address.sin_addr = conn.ip;
 
-                int connection = connect(new_socket, (struct sockaddr *)&server_address, sizeof(server_address));
-                if (connection < 0) {
-                    if (errno != EINPROGRESS) {
-                        exit(1);
+                    int connection = connect(new_socket, (struct sockaddr *)&server_address, sizeof(server_address));
+                    if (connection < 0) {
+                        if (errno != EINPROGRESS) {
+                            exit(1);
+                        }
+                    
+                    } else {
+                        conn.connected = true;
                     }
-                
+                    conn.socket = new_socket;
+                    conn.started = Timers::now();
                 }
-                start_chat(new_socket, connection);
+                start_chat();
             } 
             
         }
+
+        /**
+         * @brief method turns on tcp keepalive, so the dead connection is found in bounded time
+         *        after keepalive seconds of silence 3 probes are sent, if none is answered
+         *        (or the sent data are not acked in the same time) recv fails with ETIMEDOUT
+         */
+        void set_keepalive(int socket) {
+            int on = 1;
+            int idle = keepalive;
+            int interval = std::max(1, keepalive / 3);
+            int count = 3;
+            unsigned int user_timeout = (idle + interval * count) * 1000;
+
+            setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+            setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+            setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+            setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+            setsockopt(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof(user_timeout));
+        }
+
+        /**
+         * @brief method is called when the connect in progress finishes
+         *        checks the result and sends what was queued meanwhile
+         */
+        void finish_connect(Connection &conn) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            getsockopt(conn.socket, SOL_SOCKET, SO_ERROR, &error, &len);
+            if (error != 0) {
+                std::cout << "ERROR: Couldn't connect to the server: " << strerror(error) << std::endl;
+                exit_code = 1;
+                close_connection(conn);
+                return;
+            }
+            conn.connected = true;
+            timers.cancel(conn.connect_timer);
+            flush_out(conn);
+        }
+
+        /**
+         * @brief method sends the frame given in parts, what the socket doesn't take is queued
+         *        parts are not joined before sending, they are copied only when queued
+         */
+        void send_frame(Connection &conn, struct iovec *parts, int count) {
+            size_t total = 0;
+            for (int i = 0; i < count; i++) {
+                total += parts[i].iov_len;
+            }
+            conn.msgs_out++;
+            conn.bytes_out += total;
+
+            size_t written = 0;
+            // keep the order, if something is queued, this has to wait too
+            if (conn.connected && conn.out_pos == conn.out.size()) {
+                struct msghdr header;
+                memset(&header, 0, sizeof(header));
+                header.msg_iov = parts;
+                header.msg_iovlen = count;
+                ssize_t sent = sendmsg(conn.socket, &header, MSG_NOSIGNAL);
+                if (sent > 0) {
+                    written = sent;
+                }
+            }
+            if (written == total) {
+                return;
+            }
+            // the size is known, so the queue grows at most once
+            conn.out.reserve(conn.out.size() + total - written);
+            for (int i = 0; i < count; i++) {
+                if (written >= parts[i].iov_len) {
+                    written -= parts[i].iov_len;
+                    continue;
+                }
+                conn.out.append(static_cast<char *>(parts[i].iov_base) + written, parts[i].iov_len - written);
+                written = 0;
+            }
+        }
+
+        void send_frame(Connection &conn, Frame &frame) {
+            send_frame(conn, frame.parts, frame.count);
+        }
+
+        /**
+         * @brief method sends the queued data, called when the socket is writable again
+         */
+        void flush_out(Connection &conn) {
+            while (conn.out_pos < conn.out.size()) {
+                ssize_t sent = send(conn.socket, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos, MSG_NOSIGNAL);
+                if (sent <= 0) {
+                    // EAGAIN - wait for EPOLLOUT, other errors come with EPOLLIN
+                    return;
+                }
+                conn.out_pos += sent;
+            }
+            conn.out.clear();
+            conn.out_pos = 0;
+            if (conn.closing) {
+                drain(conn);
+            }
+        }
+
+        /**
+         * @brief method starts waiting for REPLY to AUTH or JOIN
+         *        if it doesn't come in time, it is a local error -> ERR to server and end
+         */
+        void start_reply_timer(Connection &conn) {
+            timers.cancel(conn.reply_timer);
+            conn.reply_sent_at = Timers::now();
+            size_t index = conn.index;
+            conn.reply_timer = timers.add(std::chrono::milliseconds(reply_timeout), [this, index]() {
+                Connection &conn = connections[index];
+                conn.reply_timer = 0;
+                std::cout << "ERROR: No REPLY from the server" << std::endl;
+                Frame frame;
+                frame.err(conn.display_name, "No REPLY received in time");
+                send_frame(conn, frame);
+                exit_code = 1;
+                safely_end(conn);
+            });
+        }
        
 
+        /**
+         * @brief method stops the REPLY timeout and counts the latency
+         */
+        void reply_received(Connection &conn) {
+            if (conn.reply_timer == 0) {
+                return;
+            }
+            timers.cancel(conn.reply_timer);
+            uint64_t latency = Timers::now() - conn.reply_sent_at;
+            replies++;
+            reply_latency_sum += latency;
+            reply_latency_min = std::min(reply_latency_min, latency);
+            reply_latency_max = std::max(reply_latency_max, latency);
+        }
+
+        /**
+         * @brief method returns true if some connection is waiting for REPLY, for connect
+         *        or has too much unsent data
+         */
+        bool waiting() {
+            const size_t MAX_QUEUED = 65536;
+            for (auto &conn : connections) {
+                if (!conn.closed && (conn.reply_timer != 0 || !conn.connected
+                                     || conn.out.size() - conn.out_pos > MAX_QUEUED)) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * @brief method returns true if some connection has the state change not applied yet
+         */
+        bool state_changing() {
+            for (auto &conn : connections) {
+                if (!conn.closed && conn.state != conn.next_state) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * @brief method sends script lines while the token bucket and the FSM allow it
+         *        is called on every loop iteration, when a timer ends, or new script data come
+         */
+        void script_pump() {
+            while (script.timer == 0 && !shutting_down && !state_changing()) {
+                // waiting for REPLY, the line would be rejected in AUTH/JOIN
+                if (waiting()) {
+                    return;
+                }
+                std::string_view line;
+                size_t next;
+                if (!script.peek_line(line, next)) {
+                    // everything buffered was used, read more
+                    if (script.paused) {
+                        script_poll(true);
+                    }
+                    if (script.finished() && !script.done) {
+                        script.done = true;
+                        script_report();
+                        end_all();
+                    }
+                    return;
+                }
+                if (line.empty()) {
+                    script.pos = next;
+                    continue;
+                }
+                if (line.starts_with("@sleep")) {
+                    script.pos = next;
+                    std::string_view number = line.substr(6);
+                    if (number.starts_with(' ')) {
+                        number.remove_prefix(1);
+                    }
+                    uint64_t ms;
+                    auto [end, error] = std::from_chars(number.data(), number.data() + number.size(), ms);
+                    if (number.empty() || error != std::errc() || end != number.data() + number.size()) {
+                        // typo in the script is skipped, not fatal
+                        std::cout << "ERROR: invalid @sleep" << std::endl;
+                        continue;
+                    }
+                    script_wait(std::chrono::milliseconds(ms));
+                    return;
+                }
+                uint64_t wait = script.take_token();
+                if (wait > 0) {
+                    script_wait(std::chrono::nanoseconds(wait));
+                    return;
+                }
+                script.pos = next;
+
+                Message msg;
+                // points to the script, not copied
+                msg.input = line;
+                msg.split_cmd();
+                dispatch_input(msg);
+                script.sent++;
+
+                if (script.delay > 0) {
+                    script_wait(std::chrono::milliseconds(script.delay));
+                }
+            }
+        }
+
+        /**
+         * @brief method adds the streamed script back to the epoll or removes it,
+         *        it's removed and not only without EPOLLIN, a closed pipe would still report EPOLLHUP
+         */
+        void script_poll(bool on) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.fd = script.fd;
+            epoll_ctl(epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, script.fd, &event);
+            script.paused = !on;
+        }
+
+        void script_wait(std::chrono::nanoseconds delay) {
+            script.timer = timers.add(delay, [this]() {
+                script.timer = 0;
+                script_pump();
+            });
+        }
+
+        /**
+         * @brief method prints the achieved rate and REPLY latency to stderr
+         */
+        void script_report() {
+            double seconds = (Timers::now() - script.start) / 1e9;
+            std::cerr << "Script: " << script.sent << " lines in " << seconds << " s, "
+                      << (seconds > 0 ? script.sent / seconds : 0) << " lines/s" << std::endl;
+            if (replies > 0) {
+                std::cerr << "REPLY latency: min " << reply_latency_min / 1e6
+                          << " ms, avg " << reply_latency_sum / replies / 1e6
+                          << " ms, max " << reply_latency_max / 1e6
+                          << " ms (" << replies << " replies)" << std::endl;
+            }
+        }
+
+        /**
+         * @brief method prints messages and bytes sent and received by every connection to stderr
+         */
+        void print_stats() {
+            for (auto &conn : connections) {
+                uint64_t end = conn.ended != 0 ? conn.ended : Timers::now();
+                double seconds = (end - conn.started) / 1e9;
+                char ip[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &conn.ip, ip, sizeof(ip));
+                std::cerr << "[" << conn.index + 1 << "] " << ip << ":" << conn.port;
+                if (conn.channel != Intern_table::NONE) {
+                    std::cerr << " (" << channels.name(conn.channel) << ")";
+                }
+                std::cerr << ": in " << conn.msgs_in << " msgs / " << conn.bytes_in << " B"
+                          << ", out " << conn.msgs_out << " msgs / " << conn.bytes_out << " B"
+                          << ", relayed " << conn.relayed;
+                if (seconds > 0) {
+                    std::cerr << ", " << conn.bytes_in / seconds << " B/s in"
+                              << ", " << conn.bytes_out / seconds << " B/s out";
+                }
+                std::cerr << " (" << seconds << " s)" << std::endl;
+            }
+
+            // senders with the most traffic first
+            std::vector<uint32_t> ids;
+            for (uint32_t id = 0; id < sender_counters.size(); id++) {
+                ids.push_back(id);
+            }
+            std::sort(ids.begin(), ids.end(), [this](uint32_t a, uint32_t b) {
+                return sender_counters[a].bytes > sender_counters[b].bytes;
+            });
+            const size_t TOP_SENDERS = 10;
+            for (size_t i = 0; i < ids.size() && i < TOP_SENDERS; i++) {
+                std::cerr << "sender " << senders.name(ids[i]) << ": " << sender_counters[ids[i]].msgs
+                          << " msgs / " << sender_counters[ids[i]].bytes << " B" << std::endl;
+            }
+        }
+
         /**
          * @brief method is called when the chat is started
-         *       sets up the epoll and handles both stdin and data from server
-         *       based on this, it changes the state of the FSM 
+         *       sets up the epoll and handles both stdin and data from servers
+         *       based on this, it changes the state of the FSMs
          */
-        void start_chat(int new_socket, int connection) {
+        void start_chat() {
             // read from stdin and send packets used epoll
-            int epoll_fd = epoll_create1(0);
+            epoll_fd = epoll_create1(0);
             if (epoll_fd == -1) {
                 std::cerr << "Couldn't create epoll" << std::endl;
                 exit(1);
             }
-            struct epoll_event event, events[2];
-            event.events = EPOLLIN | EPOLLET;
-            event.data.fd = new_socket;
+            const int MAX_EVENTS = 16;
+            struct epoll_event event, events[MAX_EVENTS];
+            timers.setup();
+
+            for (auto &conn : connections) {
+                // EPOLLOUT for the end of connect and for the queued data
+                event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+                event.data.fd = conn.socket;
+
+                if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn.socket, &event) == -1) {
+                    std::cerr << "Couldn't add socket to epoll" << std::endl;
+                    exit(1);
+                }
+                if (!conn.connected) {
+                    size_t index = conn.index;
+                    conn.connect_timer = timers.add(std::chrono::milliseconds(connect_timeout), [this, index]() {
+                        connections[index].connect_timer = 0;
+                        std::cout << "ERROR: Connecting to the server timed out" << std::endl;
+                        exit_code = 1;
+                        close_connection(connections[index]);
+                    });
+                }
+            }
 
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_socket, &event) == -1) {
-                std::cerr << "Couldn't add socket to epoll" << std::endl;
+            // in scripted mode the input comes from the script, not stdin
+            int input_fd = scripted ? script.fd : STDIN_FILENO;
+            if (input_fd != -1) {
+                event.events = EPOLLIN;
+                event.data.fd = input_fd;
+                if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &event) == -1) {
+                    std::cerr << "Couldn't add input to epoll" << std::endl;
+                    exit(1);
+                }
+            }
+
+            event.events = EPOLLIN;
+            event.data.fd = timers.fd;
+            if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timers.fd, &event) == -1) {
+                std::cerr << "Couldn't add timer to epoll" << std::endl;
                 exit(1);
             }
 
             event.events = EPOLLIN;
-            event.data.fd = STDIN_FILENO;
-            if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) == -1) {
-                std::cerr << "Couldn't add stdin to epoll" << std::endl;
+            event.data.fd = signal_fd;
+            if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) == -1) {
+                std::cerr << "Couldn't add signalfd to epoll" << std::endl;
                 exit(1);
             }
 
-            // in case msgs were in multiple packets
-            std::string recv_buffer;
             while(true) {
         
-                if (state != next_state) {
-                    state = next_state;
+                for (auto &conn : connections) {
+                    if (conn.state != conn.next_state) {
+                        conn.state = conn.next_state;
+                    }
                 }
-                if (state == END) {
-                    safely_end(new_socket, connection);
-                    exit(0);
+                if (scripted) {
+                    script_pump();
+                    if (state_changing()) {
+                        continue;
+                    }
                 }
-                int descriptor = epoll_wait(epoll_fd, events, 2, -1);
+                for (auto &conn : connections) {
+                    if (!conn.closed && !conn.closing && conn.state == END) {
+                        safely_end(conn);
+                    }
+                }
+                // no timeout needed, timers wake up the epoll through timerfd
+                int descriptor = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
                 if (descriptor == -1) {
-                    // ctrl +c 
+                    // signals come through signalfd, this is e.g. after SIGSTOP
                     if(errno == EINTR) {
-                        safely_end(new_socket, connection);
-                        exit(0);
+                        continue;
                     } else {
                         std::cerr << "Couldn't wait for epoll" << std::endl;
                         exit(1);
@@ -584,69 +1642,184 @@ class CHAT {
                     // maybe not nesesary
                     continue;
                 }
-                receiving_data(new_socket, connection, recv_buffer, descriptor, events);
+                receiving_data(descriptor, events);
 
             }
         }
         /**
-         * @brief method checks data from server and call receiving_stdin
+         * @brief method checks data from servers and call receiving_stdin
          */
 
-        void receiving_data(int new_socket, int connection, std::string &recv_buffer, int descriptor, struct epoll_event *events) {
+        void receiving_data(int descriptor, struct epoll_event *events) {
             for (int i = 0; i < descriptor; i++) {
-                // for handling data from socket
-                if (events[i].data.fd == new_socket) {
-                    char buffer[60034];
-                    ssize_t bytes_read = recv(new_socket, buffer, sizeof(buffer), 0);
-                    if (bytes_read == 0) {
-                        std::cerr << "Server closed the connection" << std::endl;
-                        close(new_socket);
-                        exit(0);
-                    } else if (bytes_read < 0) {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                            continue;
-                        } else {
-                            std::cerr << "Could not connect to the port" << std::endl;
-                            exit(1);
+                int fd = events[i].data.fd;
+                if (fd == timers.fd) {
+                    timers.expire();
+                } else if (fd == signal_fd) {
+                    receiving_signal();
+                } else if (scripted && fd == script.fd) {
+                    script.fill();
+                    script_pump();
+                    // the pump is blocked, don't read more until it catches up
+                    if (script.fd != -1 && script.line_ready()) {
+                        script_poll(false);
+                    }
+                } else if (!scripted && fd == STDIN_FILENO) {
+                    receiving_stdin();
+                } else {
+                    for (auto &conn : connections) {
+                        if (!conn.closed && conn.socket == fd) {
+                            receiving_socket(conn, events[i].events);
+                            break;
                         }
                     }
-                    // answer from server could be split into multiple packets
-                    // msg has to be ended with \r\n
-                    if(recv_buffer.length() > 60000) {
-                        std::cerr << "ERROR: Message too long" << std::endl;
-                        // cut the last few
-                        recv_buffer.erase(recv_buffer.end() - 500, recv_buffer.end());
+                }
+            }
+        }
+
+        /**
+         * @brief method handles the events of one server socket
+         */
+        void receiving_socket(Connection &conn, uint32_t events) {
+            if (!conn.connected) {
+                finish_connect(conn);
+                if (conn.closed) {
+                    return;
+                }
+            }
+            if (events & EPOLLOUT) {
+                flush_out(conn);
+            }
+            if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                return;
+            }
+            // edge triggered - read everything
+            while (!conn.closed) {
+                char buffer[60034];
+                ssize_t bytes_read = recv(conn.socket, buffer, sizeof(buffer), 0);
+                if (bytes_read == 0) {
+                    // after our BYE it is expected
+                    if (!conn.closing) {
+                        std::cerr << "Server closed the connection" << std::endl;
+                    }
+                    close_connection(conn);
+                    return;
+                } else if (bytes_read < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return;
                     } else {
-                        recv_buffer.append(buffer, bytes_read);
+                        // also when keepalive found the connection dead
+                        std::cerr << "Could not connect to the port: " << strerror(errno) << std::endl;
+                        exit_code = 1;
+                        close_connection(conn);
+                        return;
                     }
-                    size_t end;
-                    while ((end = recv_buffer.find("\r\n")) != std::string::npos) {
-                        std::string single_msg = recv_buffer.substr(0, end);
-                        recv_buffer.erase(0, end + 2);
-            
-                        if (!single_msg.empty()) {
-                            Message answer;
-                            answer.msg = single_msg;
-                            answer.cmd = single_msg.substr(0, single_msg.find(' '));
-
-                            std::string upper_cmd;
-                            for( auto &c : answer.cmd) {
-                                c = toupper(c);
-                                upper_cmd.append(1, c);
-                            }
-                            answer.cmd = upper_cmd;
-                            answer.socket = new_socket;
-                            answer.connection = connection;
-                            answer.answer(display_name);
-                            std::string upper_msg = msg_to_upper(answer.msg);
-                            change_state(answer.cmd, answer.msg, upper_msg);
-                        }
+                }
+                // answer from server could be split into multiple packets
+                // msg has to be ended with \r\n
+                if(conn.recv_buffer.length() > 60000) {
+                    std::cerr << "ERROR: Message too long" << std::endl;
+                    // cut the last few
+                    conn.recv_buffer.erase(conn.recv_buffer.end() - 500, conn.recv_buffer.end());
+                } else {
+                    conn.recv_buffer.append(buffer, bytes_read);
+                }
+                // the frames are only looked at, the buffer is shifted once at the end
+                size_t start = 0;
+                size_t end;
+                while ((end = conn.recv_buffer.find("\r\n", start)) != std::string::npos) {
+                    std::string_view single_msg(conn.recv_buffer.data() + start, end - start);
+                    start = end + 2;
+
+                    // after BYE nothing more is handled
+                    if (!single_msg.empty() && !conn.closing && !conn.closed) {
+                        receiving_frame(conn, single_msg);
                     }
+                }
+                conn.recv_buffer.erase(0, start);
+            }
+        }
 
+        /**
+         * @brief method handles one whole message from the server
+         */
+        void receiving_frame(Connection &conn, std::string_view single_msg) {
+            // shutdown or malformed frame earlier in the same batch, the rest isn't handled
+            if (conn.next_state == END) {
+                return;
+            }
+            Message answer;
+            // the frame stays in the receive buffer, only the short command is copied
+            answer.input = single_msg;
+            answer.cmd = std::string(single_msg.substr(0, single_msg.find(' ')));
+            for (auto &c : answer.cmd) {
+                c = toupper(c);
+            }
+            answer.socket = conn.socket;
+            answer.connection = -1;
+            answer.senders = &senders;
+            answer.origin = conn.origin;
+            answer.answer();
+            conn.msgs_in++;
+            conn.bytes_in += single_msg.size() + 2;
+            if (answer.malformed) {
+                malformed(conn, single_msg);
+                return;
+            }
+            if (answer.sender != Intern_table::NONE) {
+                if (answer.sender >= sender_counters.size()) {
+                    sender_counters.resize(answer.sender + 1);
+                }
+                sender_counters[answer.sender].msgs++;
+                sender_counters[answer.sender].bytes += single_msg.size() + 2;
+            }
+
+            change_state(conn, answer.cmd, single_msg);
+            // next message can be in the same packet (REPLY and MSG), it has to see the new state
+            conn.state = conn.next_state;
+            if (relay && answer.cmd == "MSG") {
+                relay_msg(conn, answer.display, answer.content);
+            }
+        }
+
+        /**
+         * @brief method sends ERR with the malformed message and ends only this connection
+         */
+        void malformed(Connection &conn, std::string_view error) {
+            Frame frame;
+            // too long or broken content can't be sent back, then only BYE goes
+            if (frame.err(conn.display_name, error)) {
+                send_frame(conn, frame);
+            }
+            exit_code = 1;
+            conn.next_state = END;
+            safely_end(conn);
+        }
 
-                } else if (events[i].data.fd == STDIN_FILENO) {
-                    receiving_stdin(new_socket, connection);
+        /**
+         * @brief method forwards MSG from one server to all other open connections
+         *        sender and content are the parts found by answer, sent without copying
+         */
+        void relay_msg(Connection &from, std::string_view sender, std::string_view content) {
+            // only what follows the grammar is forwarded
+            if (!Frame::is_display_name(sender) || !Frame::is_content(content)
+                || sender.size() + 2 + content.size() > Frame::MAX_CONTENT) {
+                return;
+            }
+            for (auto &to : connections) {
+                if (&to == &from || to.closed || to.closing || to.state != OPEN || to.next_state == END) {
+                    continue;
                 }
+                Frame frame;
+                frame.add("MSG FROM ");
+                frame.add(to.display_name);
+                frame.add(" IS ");
+                frame.add(sender);
+                frame.add(": ");
+                frame.add(content);
+                frame.add("\r\n");
+                send_frame(to, frame);
+                to.relayed++;
             }
         }
 
@@ -654,87 +1827,166 @@ class CHAT {
          * @brief method is called when data is received from stdin
          *        it parses the message and sets the cmd and msg variables
          */
-        void receiving_stdin(int new_socket, int connection) {
+        void receiving_stdin() {
             Message msg;
-            msg.socket = new_socket;
-            msg.connection = connection;
-            msg.decipher(display_name);
+            if (!msg.decipher(stdin_buffer)) {
+                // stdin stays readable at eof, it would wake the epoll during the whole drain
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+                end_all();
+                return;
+            }
+            dispatch_input(msg);
+        }
 
-            if(msg.cmd == "auth") {
-                int last_space = msg.msg.find_last_of(" ");
-                display_name = msg.msg.substr(last_space + 1, msg.msg.length() - last_space - 1);
+        /**
+         * @brief method sends the user input to all connections
+         *        with more servers "@<n> <input>" sends it only to the n-th one
+         */
+        void dispatch_input(Message &msg) {
+            size_t target = 0;
+            if (connections.size() > 1 && msg.cmd.size() > 1 && msg.cmd[0] == '@'
+                && msg.cmd.find_first_not_of("0123456789", 1) == std::string::npos) {
+                auto [end, error] = std::from_chars(msg.cmd.data() + 1, msg.cmd.data() + msg.cmd.size(), target);
+                // too many digits is the same as a number out of range
+                if (error != std::errc() || target < 1 || target > connections.size()) {
+                    std::cout << "ERROR: No server number " << msg.cmd.substr(1) << std::endl;
+                    return;
+                }
+                msg.input = msg.rest;
+                msg.split_cmd();
             }
-            if (msg.cmd == "rename") {
-                int space = msg.msg.find(" ");
-                display_name = msg.msg.substr(space + 1, msg.msg.length() - space - 1);
+            for (auto &conn : connections) {
+                if (conn.closed || conn.closing || conn.state == END || conn.next_state == END || (target != 0 && conn.index + 1 != target)) {
+                    continue;
+                }
+                msg.socket = conn.socket;
+                msg.connection = -1;
+                handle_input(conn, msg);
             }
-            delete_new_line_or_carriage(display_name);
-            bool skip = true;
-            int error_check = msg.msg_check(display_name);
-            if (error_check == 0) {
-                std::string upper_msg = msg_to_upper(msg.msg);
-                if (upper_msg.starts_with("MSG FROM ")) {
-                    msg.cmd = "msg";
+        }
+
+        /**
+         * @brief method checks the user input (from stdin or script), changes the state and sends it
+         *        the message is built from parts pointing into the input, see class Frame
+         */
+        void handle_input(Connection &conn, Message &msg) {
+            Frame frame;
+            std::string_view args = msg.rest;
+            std::string cmd = msg.cmd;
+            if (cmd == "auth") {
+                // <username> <secret> <display_name>
+                size_t first = args.find(' ');
+                size_t second = first == std::string_view::npos ? first : args.find(' ', first + 1);
+                std::string_view display_name = second == std::string_view::npos ? "" : args.substr(second + 1);
+                if (second == std::string_view::npos
+                    || !frame.auth(args.substr(0, first), args.substr(first + 1, second - first - 1), display_name)) {
+                    std::cout << "ERROR: Invalid auth format" << std::endl;
+                    return;
+                }
+                if (change_state_after_cmd(conn, cmd, args)) {
+                    return;
+                }
+                conn.display_name = display_name;
+
+            } else if (cmd == "join") {
+                if (!frame.join(args, conn.display_name)) {
+                    msg.malformed_answer(std::string(args));
+                    malformed(conn, args);
+                    return;
                 }
-                if (msg.cmd != "rename") {
-                    skip = change_state_after_cmd(msg.cmd, msg.msg);
+                if (change_state_after_cmd(conn, cmd, args)) {
+                    return;
                 }
-                // error or rename - dont send
-                if (!skip) {
-                    send(new_socket, msg.msg.c_str(), msg.msg.size(), 0);                        
+                conn.channel = channels.intern(args);
 
+            } else if (cmd == "rename") {
+                if (!Frame::is_display_name(args)) {
+                    std::cout << "ERROR: Invalid rename format" << std::endl;
+                    return;
+                }
+                // only local, nothing is sent
+                conn.display_name = args;
+                return;
+
+            } else {
+                if (cmd == "" && msg.input == "/help") {
+                    msg.print_help();
+                    return;
+                }
+                if (msg.input.empty()) {
+                    return;
+                }
+                if (msg.input.size() > Frame::MAX_CONTENT) {
+                    std::cout << "ERROR: Message too long" << std::endl;
+                    return;
+                }
+                // the whole line is the content
+                cmd = "msg";
+                if (!frame.msg(conn.display_name, msg.input)) {
+                    std::cout << "ERROR: Invalid message" << std::endl;
+                    return;
                 }
+                if (change_state_after_cmd(conn, cmd, msg.input)) {
+                    return;
+                }
+            }
+            send_frame(conn, frame);
+            if (cmd == "auth" || cmd == "join") {
+                start_reply_timer(conn);
             }
         }
         /**
          * @brief method based on cmd and current state changes the state
          * @return bool value used to decide whether to send packet to server
          */
-        bool change_state_after_cmd(std::string cmd,std::string msg) {
+        bool change_state_after_cmd(Connection &conn, std::string cmd, std::string_view msg) {
             bool return_val = false;
-            delete_new_line_or_carriage(msg);
-            if (state == IDLE) {
+            // the connection is already ending, nothing is sent and END is final
+            if (conn.next_state == END) {
+                return true;
+            }
+            if (conn.state == IDLE) {
                 if(cmd == "auth") {
-                    next_state = AUTH;
+                    conn.next_state = AUTH;
                 } else if(cmd == "bye") {
-                    next_state = END;
+                    conn.next_state = END;
                 } else {
                     // not specified
                     return_val = true;
-                    next_state = IDLE;
+                    conn.next_state = IDLE;
                     std::cout << "ERROR: " << msg << std::endl;
 
                 }
-            } else if (state == AUTH) {
+            } else if (conn.state == AUTH) {
                 if(cmd == "auth") {
-                    next_state = AUTH;
+                    conn.next_state = AUTH;
                 } else if(cmd == "bye" || cmd == "err") {
-                    next_state = END;
+                    conn.next_state = END;
                 } 
                 else {
                     return_val = true;
-                    next_state = AUTH;
+                    conn.next_state = AUTH;
                     std::cout << "ERROR: " << msg << std::endl;
                 }
-            } else if (state == OPEN) {
+            } else if (conn.state == OPEN) {
                 if(cmd == "bye" || cmd == "err") {
-                    next_state = END;
+                    conn.next_state = END;
                 } else if(cmd == "join") {
-                    next_state = JOIN;
+                    conn.next_state = JOIN;
                 } else if(cmd == "msg") {
-                    next_state = OPEN;
+                    conn.next_state = OPEN;
                 } else {
                     return_val = true;
-                    next_state = OPEN;
+                    conn.next_state = OPEN;
                     std::cout << "ERROR: " << msg << std::endl;
                 }
-            } else if (state == JOIN) {
+            } else if (conn.state == JOIN) {
                 if(cmd == "bye") {
-                    next_state = END;
+                    conn.next_state = END;
                 }
                 else {
                     return_val = true;
-                    next_state = JOIN;
+                    conn.next_state = JOIN;
                     std::cout << "ERROR: " << msg << std::endl;
                 }
             }
@@ -744,43 +1996,31 @@ class CHAT {
 };
 
 
-/**
- * @brief signal handler for ctrl+c
- *         sends bye message and closes the connection
- */
-void signal_handler(int signum) {
-    if (CHAT::new_socket != -1) {
-        std::string message = "BYE\r\n";
-    
-        send(CHAT::new_socket, message.c_str(), message.size(), 0);
-        
-        close(CHAT::new_socket);
-        close(CHAT::connection);
-        exit(signum);  
-    }
-}
-// needs to be here for the signal handler
-int CHAT::new_socket = -1;
-int CHAT::connection = -1;
-
 int main(int argc, char *argv[]) {
     arg_parse args;
     args.parse(argc, argv);  
 
 
-    // for ctrl+c
-    struct sigaction action;
-    action.sa_handler = signal_handler;
-    sigemptyset(&action.sa_mask);
-    action.sa_flags = 0;
-
-    sigaction(SIGINT, &action, NULL);
-
     CHAT ipk_chat;
-    ipk_chat.ip = args.ip;
-    ipk_chat.port = args.port;
+    // ctrl+c, SIGTERM and SIGUSR1 are handled in the epoll loop
+    ipk_chat.setup_signals();
+    for (auto &server : args.servers) {
+        ipk_chat.add_server(server.ip, static_cast<uint16_t>(server.port));
+    }
     ipk_chat.timeout = args.timeout;
     ipk_chat.udp_max_retrans = args.udp_max_retrans;
+    ipk_chat.connect_timeout = args.connect_timeout;
+    ipk_chat.keepalive = args.keepalive;
+    ipk_chat.shutdown_timeout = args.shutdown_timeout;
+    ipk_chat.relay = args.relay;
+    ipk_chat.stats = args.stats;
+    if (!args.script_path.empty()) {
+        ipk_chat.scripted = true;
+        ipk_chat.script.rate = args.rate;
+        ipk_chat.script.burst = args.burst;
+        ipk_chat.script.delay = args.delay;
+        ipk_chat.script.open_file(args.script_path);
+    }
     ipk_chat.tcp = args.protocol == "tcp" ? true : false;
     ipk_chat.setup_socket();
 